@@ -4,97 +4,442 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/mount.h>        /* mnt_want_write_file   */
+#include <linux/lz4.h>          /* LZ4 (compresión)      */
+#include <linux/xxhash.h>       /* xxh64 (deduplicación) */
+#include <linux/fiemap.h>       /* fiemap                */
+#include <linux/blkdev.h>       /* discard, blkdev_get   */
+#include <linux/workqueue.h>    /* delayed_work          */
+#include <linux/namei.h>        /* lookup_one_len        */
+#include <linux/security.h>     /* security_inode_create */
+#include <linux/fsnotify.h>     /* fsnotify_create       */
+#include <linux/fileattr.h>     /* fileattr (chattr)     */
 #include "assoofs.h"
 
 MODULE_LICENSE("GPL");
 
+/*
+ *  Información en memoria del superbloque (campo s_fs_info)
+ */
+#define ASSOOFS_MOUNT_COMPRESS 0x1 //Opción de montaje "compress": todos los ficheros nuevos se comprimen
+#define ASSOOFS_MOUNT_DEDUP    0x2 //Opción de montaje "dedup": los bloques de datos con el mismo contenido se comparten
+#define ASSOOFS_MOUNT_DISCARD  0x4 //Opción de montaje "discard": los bloques liberados se descartan en el dispositivo
+#define ASSOOFS_DISCARD_DELAY  HZ  //Ventana en la que se acumulan bloques liberados antes de descartarlos juntos
+#define ASSOOFS_DEVICE_FMODE   (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+#define ASSOOFS_BLOCK_SECTORS  (ASSOOFS_DEFAULT_BLOCK_SIZE >> SECTOR_SHIFT)
+
+struct assoofs_fs_info {
+    struct super_block *sb;
+    struct assoofs_super_block_info *sb_info; //Información persistente, apunta a bh -> b_data
+    struct buffer_head *bh; //Bloque del superbloque, se mantiene mientras el sistema esté montado
+    unsigned long mount_opts;
+    uint64_t discard_pending; //Bloques liberados pendientes de descartar (cada bit lo protege el cerrojo de su grupo)
+    uint64_t discard_busy; //Bloques libres que se están descartando: no se asignan hasta que termina el discard (se modifica con todos los cerrojos)
+    struct delayed_work discard_work;
+    int nr_devices;
+    uint64_t stripe_unit;
+    struct block_device *bdev[ASSOOFS_MAX_DEVICES]; //bdev[0] es el dispositivo montado (sb -> s_bdev)
+    char *device_paths; //Opción "devices=": resto de miembros separados por ':'. Apunta a las opciones, sólo se usa en assoofs_fill_super
+    //Un cerrojo por grupo de asignación: protege sus bits de free_blocks y free_inodes, y el block_refcount y la entrada del índice de deduplicación de sus bloques
+    struct mutex group_lock[ASSOOFS_GROUP_COUNT];
+    struct mutex inode_store_lock; //Protege inodes_count y el final del almacén de inodos
+};
+
+static inline struct assoofs_fs_info *assoofs_get_fs_info(struct super_block *sb) {
+    return sb -> s_fs_info;
+}
+
+static inline struct assoofs_super_block_info *assoofs_get_sb_info(struct super_block *sb) {
+    return assoofs_get_fs_info(sb) -> sb_info;
+}
+
+/*
+ * Traduce un bloque lógico al dispositivo y bloque físico que lo contienen. A partir de
+ * ASSOOFS_FIRST_STRIPED_BLOCK los bloques se reparten por turnos entre los dispositivos, en tramos
+ * de stripe_unit bloques; en todos los miembros la zona repartida empieza en ese mismo bloque físico.
+ */
+static struct block_device *assoofs_map_block(struct super_block *sb, uint64_t block, sector_t *phys) {
+    struct assoofs_fs_info *fs_info = sb -> s_fs_info;
+    uint64_t stripe, offset;
+
+    if (fs_info -> nr_devices <= 1 || block < ASSOOFS_FIRST_STRIPED_BLOCK) {
+        *phys = block;
+        return sb -> s_bdev;
+    }
+
+    offset = block - ASSOOFS_FIRST_STRIPED_BLOCK;
+    stripe = offset / fs_info -> stripe_unit;
+    *phys = ASSOOFS_FIRST_STRIPED_BLOCK + (stripe / fs_info -> nr_devices) * fs_info -> stripe_unit + offset % fs_info -> stripe_unit;
+
+    return fs_info -> bdev[stripe % fs_info -> nr_devices];
+}
+
+//sb_bread y sb_getblk para bloques de datos y directorios, que pueden estar en cualquier miembro del volumen
+static inline struct buffer_head *assoofs_bread(struct super_block *sb, uint64_t block) {
+    sector_t phys;
+    struct block_device *bdev = assoofs_map_block(sb, block, &phys);
+
+    return __bread(bdev, phys, ASSOOFS_DEFAULT_BLOCK_SIZE);
+}
+
+static inline struct buffer_head *assoofs_getblk(struct super_block *sb, uint64_t block) {
+    sector_t phys;
+    struct block_device *bdev = assoofs_map_block(sb, block, &phys);
+
+    return __getblk(bdev, phys, ASSOOFS_DEFAULT_BLOCK_SIZE);
+}
+
+static inline int assoofs_block_group(uint64_t block) {
+    return block / ASSOOFS_BLOCKS_PER_GROUP;
+}
+
+static inline int assoofs_inode_group(uint64_t inode_no) {
+    return (inode_no - 1) / ASSOOFS_INODES_PER_GROUP;
+}
+
 /* 
  *  PROTOTIPOS
  */
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
 struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, int group, uint64_t *block);
+int assoofs_sb_get_a_freeinode(struct super_block *sb, int group, uint64_t *inode_no);
+static void assoofs_sb_put_inode(struct super_block *sb, uint64_t inode_no);
+static int assoofs_find_dir_group(struct super_block *sb);
+static int __assoofs_group_alloc_block(struct super_block *sb, int g);
+static int __assoofs_group_alloc_inode(struct super_block *sb, int g);
+static void assoofs_sb_get_block(struct super_block *sb, uint64_t block);
+static void assoofs_sb_put_block(struct super_block *sb, uint64_t block);
+static void __assoofs_sb_put_block(struct super_block *sb, uint64_t block);
+static int assoofs_dedup_get_block(struct super_block *sb, const char *block_data, uint64_t hash, uint64_t *block);
+static int __assoofs_dedup_find(struct super_block *sb, int g, const char *block_data, uint64_t hash);
+static void assoofs_write_block(struct super_block *sb, uint64_t block, const char *block_data);
+static void assoofs_lock_all_groups(struct super_block *sb);
+static void assoofs_unlock_all_groups(struct super_block *sb);
+static int assoofs_trim_free_blocks(struct super_block *sb, uint64_t candidates, uint64_t minlen, uint64_t *trimmed);
+static int assoofs_fitrim(struct super_block *sb, struct fstrim_range __user *arg);
+static int assoofs_issue_discard(struct super_block *sb, uint64_t candidates);
+static int assoofs_discard_supported(struct super_block *sb);
+static int assoofs_open_devices(struct super_block *sb, struct assoofs_fs_info *fs_info);
+static void assoofs_close_devices(struct assoofs_fs_info *fs_info);
+static int assoofs_check_member(struct assoofs_super_block_info *assoofs_sb, struct block_device *bdev, int index);
+static int assoofs_make_block_image(struct assoofs_inode_info *inode_info, const char *data, uint64_t size, char *block_data, int *clen);
+static int assoofs_store_block(struct super_block *sb, struct assoofs_inode_info *inode_info, const char *block_data);
+static void assoofs_release_block(struct super_block *sb, struct assoofs_inode_info *inode_info);
 void assoofs_save_sb_info(struct super_block *vsb);
+static void assoofs_dirty_sb_info(struct super_block *sb);
+static void assoofs_sync_sb_info(struct super_block *sb);
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static int assoofs_read_data(struct super_block *sb, struct assoofs_inode_info *inode_info, char *data);
+static int assoofs_write_data(struct super_block *sb, struct assoofs_inode_info *inode_info, const char *data, uint64_t size);
+static uint64_t assoofs_new_inode_flags(struct super_block *sb, struct assoofs_inode_info *parent_inode_info);
+static uint64_t assoofs_max_file_size(struct assoofs_inode_info *inode_info);
+long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int assoofs_bulk_create(struct file *filp, struct assoofs_bulk_create __user *arg);
 
 /*
  *  Operaciones sobre ficheros
  */
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+loff_t assoofs_llseek(struct file *filp, loff_t offset, int whence);
+loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
 const struct file_operations assoofs_file_operations = {
     .read = assoofs_read,
     .write = assoofs_write,
+    .llseek = assoofs_llseek, //SEEK_HOLE y SEEK_DATA
+    .unlocked_ioctl = assoofs_ioctl,
+    .remap_file_range = assoofs_remap_file_range, //FICLONE, FICLONERANGE y FIDEDUPERANGE
 };
 
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
-    struct buffer_head *bh;
-    char *buffer;
+    struct inode *inode = filp -> f_path.dentry -> d_inode;
+    struct super_block *sb = inode -> i_sb;
+    struct assoofs_inode_info inode_info;
+    char *buffer = NULL;
     int nbytes;
-    int a;
+    int ret;
 
-    /*Obtener la informacion persistente del inodo a partir de filp*/
-    struct assoofs_inode_info *inode_info = filp -> f_path.dentry -> d_inode -> i_private;
-        
     printk(KERN_INFO "Read request\n");
 
+    /*
+     * Obtener la informacion persistente del inodo a partir de filp. Una escritura puede mover el fichero a otro
+     * bloque (copia en escritura, deduplicación, hueco) y liberar el anterior, así que se lee con el inodo
+     * bloqueado y a partir de una única copia de file_size, data_block_number y disk_size.
+     */
+    inode_lock_shared(inode);
+    memcpy(&inode_info, inode -> i_private, sizeof(inode_info));
+
     /*Comprobar el valor de ppos por si se ha alcanzado el final del fichero*/
-    if (*ppos >= inode_info -> file_size) return 0;
+    ret = 0;
+    if (*ppos >= inode_info.file_size) goto out;
+
+    nbytes = min((size_t) (inode_info.file_size - *ppos), len); //Hay que comparar len con lo que queda de fichero por si llegamos al final del fichero
+
+    /*Fichero disperso: el hueco se lee como ceros sin acceder al disco*/
+    if (inode_info.data_block_number == ASSOOFS_NO_BLOCK) {
+        ret = -EFAULT;
+        if (clear_user(buf, nbytes)) goto out;
+    } else {
+        /*Acceder al contenido del fichero (descomprimido si es necesario)*/
+        ret = -ENOMEM;
+        buffer = kmalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+        if (!buffer) goto out;
 
-    /*Acceder al contenido del fichero*/
-    bh = sb_bread(filp -> f_path.dentry -> d_inode -> i_sb, inode_info -> data_block_number);
-    buffer = (char *)bh -> b_data;
+        ret = assoofs_read_data(sb, &inode_info, buffer);
+        if (ret) goto out;
 
-    /*Copiar en el buffer "buf" el contenido del fichero leído en el paso anterior con la función copy_to_user*/
-    nbytes = min((size_t) inode_info -> file_size, len); //Hay que comparar len con el tamaño del fichero por si llegamos al final del fichero
-    a = copy_to_user(buf, buffer, nbytes);
+        /*Copiar en el buffer "buf" el contenido del fichero leído en el paso anterior con la función copy_to_user*/
+        ret = -EFAULT;
+        if (copy_to_user(buf, buffer + *ppos, nbytes)) goto out;
+    }
 
     /*Incrementar el valor de ppos y devolver el nº de bytes leídos*/
     *ppos += nbytes;
+    ret = nbytes;
     
     printk(KERN_INFO "Operación de lectura completa");
+
+out:
+    inode_unlock_shared(inode);
+    kfree(buffer);
     
-    return nbytes;
+    return ret;
 }
 
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
-    struct buffer_head *bh;
+    struct inode *inode = filp -> f_path.dentry -> d_inode;
+    struct super_block *sb  = inode -> i_sb;
     char *buffer;
-    struct super_block *sb  = filp -> f_path.dentry -> d_inode -> i_sb;
-    int a;
+    size_t max_size;
+    int ret;
 
     /*Obtener la informacion persistente del inodo a partir de filp*/
-    struct assoofs_inode_info *inode_info = filp -> f_path.dentry -> d_inode -> i_private;
+    struct assoofs_inode_info *inode_info = inode -> i_private;
         
     printk(KERN_INFO "Write request\n");
 
-    /*Comprobar el valor de ppos por si se ha alcanzado el final del fichero*/
-    if (*ppos >= ASSOOFS_DEFAULT_BLOCK_SIZE) return 0;
+    /*Acceder al contenido actual del fichero*/
+    buffer = kzalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+    if (!buffer) return -ENOMEM;
+
+    inode_lock(inode);
 
-    /*Acceder al contenido del fichero*/
-    bh = sb_bread(filp -> f_path.dentry -> d_inode -> i_sb, inode_info -> data_block_number);
-    buffer = (char *)bh -> b_data;
+    /*Comprobar el valor de ppos por si se ha alcanzado el final del fichero. Los ficheros comprimidos admiten un cluster completo*/
+    max_size = assoofs_max_file_size(inode_info);
+    ret = 0;
+    if (*ppos >= max_size) goto out;
+    len = min(len, (size_t) (max_size - *ppos));
 
-    buffer += *ppos; //Incrementamos el puntero tanto como indique ppos(donde apunta el fichero)
+    ret = assoofs_read_data(sb, inode_info, buffer);
+    if (ret) goto out;
 
     /*Escribir en el fichero los datos obtenidos de buf*/
-    a = copy_from_user(buffer, buf, len);
+    if (copy_from_user(buffer + *ppos, buf, len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /*Guardar el contenido en el bloque de datos y actualizar el campo file_size de la información persistente del inodo*/
+    ret = assoofs_write_data(sb, inode_info, buffer, *ppos + len);
 
-    /*Incrementar el valor de ppos, marcar el bloque como sucio y sincronizarlo*/
+    //Cluster incompresible: se guarda en bruto, así que sólo se escribe lo que cabe en un bloque (escritura parcial)
+    if (ret == -EFBIG && *ppos < ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        len = ASSOOFS_DEFAULT_BLOCK_SIZE - *ppos;
+        ret = assoofs_write_data(sb, inode_info, buffer, *ppos + len);
+    }
+    if (ret) goto out;
+    i_size_write(inode, inode_info -> file_size);
+
+    /*Incrementar el valor de ppos y devolver el nº de bytes escritos*/
     *ppos += len;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    //brelse(bh);
-    
-    /*Actualizar el campo file_size de la información persistente del inodo y devovler el nº de bytes escritos*/
-    inode_info -> file_size = *ppos;
-    assoofs_save_inode_info(sb, inode_info);
+    ret = len;
     
     printk(KERN_INFO "Operación de escritura completa");
+
+out:
+    inode_unlock(inode);
+    kfree(buffer);
     
-    return len;
+    return ret;
+}
+
+/*
+ * Un fichero tiene datos en [0, file_size) si tiene bloque asignado; si no, es un único hueco.
+ */
+loff_t assoofs_llseek(struct file *filp, loff_t offset, int whence) {
+    struct inode *inode = file_inode(filp);
+    struct assoofs_inode_info *inode_info = inode -> i_private;
+    loff_t size, max_size;
+    int hole;
+
+    //Una sola lectura de los campos del inodo, que una escritura concurrente puede cambiar
+    inode_lock_shared(inode);
+    size = inode_info -> file_size;
+    max_size = assoofs_max_file_size(inode_info);
+    hole = inode_info -> data_block_number == ASSOOFS_NO_BLOCK;
+    inode_unlock_shared(inode);
+
+    switch (whence) {
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        if (offset < 0 || offset >= size) return -ENXIO;
+
+        if (hole) {
+            if (whence == SEEK_DATA) return -ENXIO;
+        } else if (whence == SEEK_HOLE) {
+            offset = size; //Hueco implícito al final del fichero
+        }
+
+        return vfs_setpos(filp, offset, max_size);
+
+    default:
+        return generic_file_llseek_size(filp, offset, whence, max_size, size);
+    }
+}
+
+/*
+ * Clonado (reflink) y deduplicación de ficheros: el fichero destino pasa a apuntar al bloque de datos
+ * del origen, que queda compartido. La primera escritura en cualquiera de los dos hace copia en
+ * escritura (ver assoofs_store_block). Como cada fichero ocupa un único bloque, sólo se pueden
+ * compartir ficheros completos: rangos desde el offset 0 que cubran todo el origen y el destino.
+ * Las comprobaciones son las de generic_remap_file_range_prep, que no se puede usar porque compara
+ * el contenido a través de la caché de páginas y assoofs no tiene address_space_operations.
+ */
+loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+    struct inode *src = file_inode(file_in);
+    struct inode *dst = file_inode(file_out);
+    struct assoofs_inode_info *src_info = src -> i_private;
+    struct assoofs_inode_info *dst_info = dst -> i_private;
+    struct super_block *sb = src -> i_sb;
+    char *src_data = NULL;
+    char *dst_data = NULL;
+    loff_t size;
+    loff_t ret;
+
+    printk(KERN_INFO "Remap file range request\n");
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY)) return -EINVAL;
+    if (!(remap_flags & REMAP_FILE_DEDUP) && (file_out -> f_flags & O_APPEND)) return -EBADF;
+
+    lock_two_nondirectories(src, dst);
+
+    ret = -EPERM;
+    if (IS_IMMUTABLE(dst) || IS_APPEND(dst)) goto out;
+    ret = -ETXTBSY;
+    if (IS_SWAPFILE(src) || IS_SWAPFILE(dst)) goto out;
+    ret = -EINVAL;
+    if (!S_ISREG(src -> i_mode) || !S_ISREG(dst -> i_mode) || src == dst) goto out;
+
+    size = src_info -> file_size;
+
+    //Longitud 0: la deduplicación termina sin hacer nada y el clonado llega hasta el final del origen
+    ret = 0;
+    if (len == 0 && (remap_flags & REMAP_FILE_DEDUP)) goto out;
+
+    //Como en generic_remap_checks, un clonado que pasa del final del origen se recorta hasta él
+    if (len == 0 || (len > size && (!(remap_flags & REMAP_FILE_DEDUP) || (remap_flags & REMAP_FILE_CAN_SHORTEN)))) len = size;
+    if (!len) goto out;
+
+    //Un destino más grande no puede conservar su cola: hay que truncarlo antes (O_TRUNC, ver assoofs_setattr)
+    ret = -EINVAL;
+    if (pos_in || pos_out || len != size || dst_info -> file_size > len) goto out;
+
+    //Un destino sin comprimir no puede apuntar a un cluster de más de un bloque (ver assoofs_fileattr_set)
+    ret = -EFBIG;
+    if (size > ASSOOFS_DEFAULT_BLOCK_SIZE && !(dst_info -> flags & ASSOOFS_INODE_COMPRESSED)) goto out;
+
+    if (remap_flags & REMAP_FILE_DEDUP) {
+        //Sólo se comparte si el contenido es idéntico
+        src_data = kzalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+        dst_data = kzalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+        if (!src_data || !dst_data) {
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        ret = assoofs_read_data(sb, src_info, src_data);
+        if (!ret) ret = assoofs_read_data(sb, dst_info, dst_data);
+        if (ret) goto out;
+
+        if (dst_info -> file_size != len || memcmp(src_data, dst_data, len)) {
+            ret = -EBADE;
+            goto out;
+        }
+    } else {
+        //Igual que una escritura: quita los bits suid/sgid y actualiza las fechas del destino
+        ret = file_modified(file_out);
+        if (ret) goto out;
+    }
+
+    if (dst_info -> data_block_number != src_info -> data_block_number) {
+        assoofs_sb_get_block(sb, src_info -> data_block_number);
+        assoofs_sb_put_block(sb, dst_info -> data_block_number);
+        dst_info -> data_block_number = src_info -> data_block_number;
+    }
+
+    dst_info -> file_size = src_info -> file_size;
+    dst_info -> disk_size = src_info -> disk_size;
+    assoofs_save_inode_info(sb, dst_info);
+    i_size_write(dst, dst_info -> file_size);
+
+    ret = len;
+
+out:
+    unlock_two_nondirectories(src, dst);
+    kfree(src_data);
+    kfree(dst_data);
+
+    return ret;
+}
+
+/*
+ *  Operaciones ioctl (ficheros y directorios)
+ */
+long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct inode *inode = file_inode(filp);
+
+    switch (cmd) {
+    case FITRIM:
+        return assoofs_fitrim(inode -> i_sb, (struct fstrim_range __user *) arg);
+
+    case ASSOOFS_IOC_BULK_CREATE:
+        return assoofs_bulk_create(filp, (struct assoofs_bulk_create __user *) arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+//FITRIM (fstrim): descarta todos los bloques libres del rango pedido, en tramos contiguos de al menos minlen bytes
+static int assoofs_fitrim(struct super_block *sb, struct fstrim_range __user *arg) {
+    struct request_queue *q = bdev_get_queue(sb -> s_bdev);
+    struct fstrim_range range;
+    uint64_t first, last, minlen;
+    uint64_t trimmed = 0;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+    if (!assoofs_discard_supported(sb)) return -EOPNOTSUPP;
+    if (copy_from_user(&range, arg, sizeof(range))) return -EFAULT;
+
+    if (range.start >= (uint64_t) ASSOOFS_BLOCK_MAP_SIZE * ASSOOFS_DEFAULT_BLOCK_SIZE) return -EINVAL;
+
+    first = range.start / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    last = min_t(uint64_t, first + range.len / ASSOOFS_DEFAULT_BLOCK_SIZE, ASSOOFS_BLOCK_MAP_SIZE);
+    minlen = max_t(uint64_t, range.minlen, q -> limits.discard_granularity);
+    minlen = max_t(uint64_t, DIV_ROUND_UP(minlen, ASSOOFS_DEFAULT_BLOCK_SIZE), 1);
+
+    ret = 0;
+    if (last > first)
+        ret = assoofs_trim_free_blocks(sb, GENMASK_ULL(last - 1, first), minlen, &trimmed);
+
+    range.len = trimmed * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (copy_to_user(arg, &range, sizeof(range))) return -EFAULT;
+
+    return ret;
 }
 
 /*
@@ -104,6 +449,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
     .iterate = assoofs_iterate,
+    .unlocked_ioctl = assoofs_ioctl,
 };
 
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
@@ -129,7 +475,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
     if ((!S_ISDIR(inode_info -> mode))) return -1;
 
     /* 4. Accedemos al bloque donde se almacena el contenido del directorio y con la información que contiene inicializamos el contexto ctx */
-    bh = sb_bread(sb, inode_info -> data_block_number);
+    bh = assoofs_bread(sb, inode_info -> data_block_number);
     record = (struct assoofs_dir_record_entry *)bh -> b_data; //Contenido del bloque en campo b_data
 
     for (i = 0; i < inode_info -> dir_children_count; i++) { //Iteraciones = nº de archivos
@@ -151,12 +497,121 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
 static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir , struct dentry *dentry, umode_t mode);
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
+static int assoofs_fileattr_get(struct dentry *dentry, struct fileattr *fa);
+static int assoofs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry, struct fileattr *fa);
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr);
 static struct inode_operations assoofs_inode_ops = {
     .create = assoofs_create, //crear inodos
     .lookup = assoofs_lookup, //recorre el arbol de inodos y dado un nombre de fichero obtener su ID(inodo)
     .mkdir = assoofs_mkdir, //crear directorios
+    .fiemap = assoofs_fiemap, //mapa de bloques asignados (FS_IOC_FIEMAP)
+    .fileattr_get = assoofs_fileattr_get, //FS_IOC_GETFLAGS (lsattr)
+    .fileattr_set = assoofs_fileattr_set, //FS_IOC_SETFLAGS (chattr)
+    .setattr = assoofs_setattr, //truncate y O_TRUNC
 };
 
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len) {
+    struct assoofs_inode_info *inode_info = inode -> i_private;
+    struct assoofs_super_block_info *assoofs_sb = assoofs_get_sb_info(inode -> i_sb);
+    u32 flags = FIEMAP_EXTENT_LAST;
+    sector_t phys;
+    u64 size;
+    int ret;
+
+    ret = fiemap_prep(inode, fieinfo, start, &len, 0);
+    if (ret) return ret;
+
+    //Con el inodo bloqueado el bloque de datos no se puede mover ni liberar mientras se informa de él
+    inode_lock_shared(inode);
+
+    //Como mucho hay una extensión: el bloque de datos del inodo
+    size = S_ISDIR(inode_info -> mode) ? ASSOOFS_DEFAULT_BLOCK_SIZE : inode_info -> file_size;
+    if (inode_info -> data_block_number == ASSOOFS_NO_BLOCK || start >= size) goto out;
+
+    if (inode_info -> disk_size) flags |= FIEMAP_EXTENT_ENCODED; //Cluster comprimido
+    if (assoofs_sb -> block_refcount[inode_info -> data_block_number] > 1) flags |= FIEMAP_EXTENT_SHARED;
+
+    //En un volumen repartido sólo tiene sentido la dirección de los bloques del dispositivo principal
+    if (assoofs_map_block(inode -> i_sb, inode_info -> data_block_number, &phys) != inode -> i_sb -> s_bdev) {
+        flags |= FIEMAP_EXTENT_UNKNOWN;
+        phys = 0;
+    }
+
+    ret = fiemap_fill_next_extent(fieinfo, 0, (u64) phys * ASSOOFS_DEFAULT_BLOCK_SIZE, size, flags);
+
+out:
+    inode_unlock_shared(inode);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int assoofs_fileattr_get(struct dentry *dentry, struct fileattr *fa) {
+    struct assoofs_inode_info *inode_info = d_inode(dentry) -> i_private;
+
+    fileattr_fill_flags(fa, (inode_info -> flags & ASSOOFS_INODE_COMPRESSED) ? FS_COMPR_FL : 0);
+
+    return 0;
+}
+
+/*
+ * Sólo se admite FS_COMPR_FL (chattr +c). En un directorio lo heredan los ficheros que se creen después.
+ * La VFS ya ha comprobado el propietario y el acceso de escritura al montaje, y tiene el inodo bloqueado.
+ */
+static int assoofs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry, struct fileattr *fa) {
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *inode_info = inode -> i_private;
+
+    if (fileattr_has_fsx(fa) || (fa -> flags & ~FS_COMPR_FL)) return -EOPNOTSUPP;
+
+    if (fa -> flags & FS_COMPR_FL) {
+        inode_info -> flags |= ASSOOFS_INODE_COMPRESSED;
+    } else {
+        //Sin comprimir el fichero ya no cabría en su bloque
+        if (S_ISREG(inode_info -> mode) && inode_info -> file_size > ASSOOFS_DEFAULT_BLOCK_SIZE) return -EFBIG;
+        inode_info -> flags &= ~ASSOOFS_INODE_COMPRESSED;
+    }
+
+    assoofs_save_inode_info(inode -> i_sb, inode_info);
+    inode -> i_ctime = current_time(inode);
+
+    return 0;
+}
+
+/*
+ * Cambio de atributos. El tamaño (truncate, O_TRUNC) se guarda en file_size reescribiendo el contenido con la
+ * nueva longitud, como una escritura: al acortar se descarta el final y al alargar se rellena con ceros.
+ * La VFS tiene el inodo bloqueado.
+ */
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *inode_info = inode -> i_private;
+    char *buffer;
+    int ret;
+
+    ret = setattr_prepare(mnt_userns, dentry, attr);
+    if (ret) return ret;
+
+    if ((attr -> ia_valid & ATTR_SIZE) && S_ISREG(inode_info -> mode) && attr -> ia_size != inode_info -> file_size) {
+        if (attr -> ia_size > assoofs_max_file_size(inode_info)) return -EFBIG;
+
+        buffer = kzalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+        if (!buffer) return -ENOMEM;
+
+        ret = assoofs_read_data(inode -> i_sb, inode_info, buffer);
+        if (!ret) ret = assoofs_write_data(inode -> i_sb, inode_info, buffer, attr -> ia_size);
+        kfree(buffer);
+        if (ret) return ret;
+
+        i_size_write(inode, inode_info -> file_size);
+        inode -> i_mtime = inode -> i_ctime = current_time(inode);
+    }
+
+    setattr_copy(mnt_userns, inode, attr);
+
+    return 0;
+}
+
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
     //1
     struct assoofs_inode_info *parent_info = parent_inode -> i_private;
@@ -171,7 +626,7 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
     printk(KERN_INFO "Lookup request\n");
 
     /* 1. Acceder al bloque de disco con el contenido del directorio apuntado por parent_inode */
-    bh = sb_bread(sb, parent_info -> data_block_number);
+    bh = assoofs_bread(sb, parent_info -> data_block_number);
     /* 2. Recorrer el contenido del directorio buscando la entrada cuyo nombre se corresponda con el que buscamos. Si se localiza la entrada, entonces tenemos que construir el inodo correspondiente */
     record = (struct assoofs_dir_record_entry *) bh -> b_data;
 
@@ -196,7 +651,8 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
     //1
     struct inode *inode;
     struct super_block *sb;
-    uint64_t count;
+    uint64_t ino;
+    int group;
     struct assoofs_inode_info *inode_info;
     //2
     struct assoofs_inode_info *parent_inode_info;
@@ -207,25 +663,28 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 
     /* 1. Crear el nuevo inodo */
     sb = dir -> i_sb; //Obtengo un puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *) sb -> s_fs_info) -> inodes_count; //obtengo el nº de inodos en la información persistente del superbloque
+
+    //Los ficheros se colocan en el grupo de asignación de su directorio padre
+    group = assoofs_inode_group(((struct assoofs_inode_info *) dir -> i_private) -> inode_no);
+    if (assoofs_sb_get_a_freeinode(sb, group, &ino)) {
+        printk(KERN_ERR "Assoofs %d max file system objects suported\n", ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+
+        return -ENOSPC;
+    }
     
     inode = new_inode(sb);
     inode -> i_sb = sb;
     inode -> i_atime = inode -> i_mtime = inode -> i_ctime = current_time(inode);
     inode -> i_op = &assoofs_inode_ops;
-    inode -> i_ino = count + 1; //asigno nº al nuevo inodo a partir de count
-
-    if (inode -> i_ino > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
-        printk(KERN_ERR "Assoofs %d max file system objects suported\n", ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
-
-        return -1;
-    }
+    inode -> i_ino = ino; //asigno nº al nuevo inodo, tomado del mapa de inodos libres del grupo
     
     //Guardar en el campo i_private la info persistente del mismo. Es un nuevo inodo y hay que crearlo desde cero
     inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
     inode_info -> inode_no = inode -> i_ino;
     inode_info -> mode = mode; //el segundo mode llega como argumento
     inode_info -> file_size = 0;
+    inode_info -> flags = assoofs_new_inode_flags(sb, dir -> i_private);
+    inode_info -> disk_size = 0;
     inode -> i_private = inode_info;
 
     //Para las operaciones sobre ficheros
@@ -235,10 +694,8 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
     inode_init_owner(sb -> s_user_ns, inode, dir, mode);
     d_add(dentry, inode);
 
-    //Asignación de bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
-    assoofs_sb_get_a_freeblock(sb, &inode_info -> data_block_number);
-
-    printk(KERN_INFO "Found a free block in the bit map\n");
+    //El fichero nace vacío y sin bloque (disperso): el bloque se asigna en la primera escritura con datos
+    inode_info -> data_block_number = ASSOOFS_NO_BLOCK;
 
     //Guardar la información persistente del nuevo inodo en disco
     assoofs_add_inode_info(sb, inode_info);
@@ -248,7 +705,7 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
      * El nombre se sacará del tercer parámetro
      */ 
     parent_inode_info = dir -> i_private;
-    bh = sb_bread(sb, parent_inode_info -> data_block_number);
+    bh = assoofs_bread(sb, parent_inode_info -> data_block_number);
 
     dir_contents = (struct assoofs_dir_record_entry *) bh -> b_data;
     dir_contents += parent_inode_info -> dir_children_count;
@@ -273,7 +730,9 @@ static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir ,
     //1
     struct inode *inode;
     struct super_block *sb;
-    uint64_t count;
+    uint64_t ino;
+    uint64_t block;
+    int group;
     struct assoofs_inode_info *inode_info;
     //2
     struct assoofs_inode_info *parent_inode_info;
@@ -284,25 +743,37 @@ static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir ,
 
     /* 1. Crear el nuevo inodo */
     sb = dir -> i_sb; //Obtengo un puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *) sb -> s_fs_info) -> inodes_count; //obtengo el nº de inodos en la información persistente del superbloque
+
+    //Los directorios se reparten entre los grupos de asignación
+    group = assoofs_find_dir_group(sb);
+    if (assoofs_sb_get_a_freeinode(sb, group, &ino)) {
+        printk(KERN_ERR "Assoofs %d max file system objects suported\n", ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+
+        return -ENOSPC;
+    }
+
+    //Asignación de bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits de su grupo. Si no quedan se devuelve el inodo
+    if (assoofs_sb_get_a_freeblock(sb, assoofs_inode_group(ino), &block)) {
+        assoofs_sb_put_inode(sb, ino);
+
+        return -ENOSPC;
+    }
+    printk(KERN_INFO "Buscado el bloque libre en el mapa de bits\n");
     
     inode = new_inode(sb);
     inode -> i_sb = sb;
     inode -> i_atime = inode -> i_mtime = inode -> i_ctime = current_time(inode);
     inode -> i_op = &assoofs_inode_ops;
-    inode -> i_ino = count + 1; //asigno nº al nuevo inodo a partir de count
-
-    if (inode -> i_ino > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
-        printk(KERN_ERR "Assoofs %d max file system objects suported\n", ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
-
-        return -1;
-    }
+    inode -> i_ino = ino; //asigno nº al nuevo inodo, tomado del mapa de inodos libres del grupo
     
     //Guardar en el campo i_private la info persistente del mismo. Es un nuevo inodo y hay que crearlo desde cero
     inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
     inode_info -> inode_no = inode -> i_ino;
     inode_info -> mode = S_IFDIR | mode; //el segundo mode llega como argumento
+    inode_info -> data_block_number = block;
     inode_info -> dir_children_count = 0;
+    inode_info -> flags = assoofs_new_inode_flags(sb, dir -> i_private);
+    inode_info -> disk_size = 0;
     inode -> i_private = inode_info;
 
     //Para las operaciones sobre ficheros
@@ -314,10 +785,6 @@ static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir ,
 
     printk(KERN_INFO "Guardada la información necesaria en el nodo\n");
 
-    //Asignación de bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
-    assoofs_sb_get_a_freeblock(sb, &inode_info -> data_block_number);
-    printk(KERN_INFO "Buscado el bloque libre en el mapa de bits\n");
-
     //Guardar la información persistente del nuevo inodo en disco
     assoofs_add_inode_info(sb, inode_info);
     printk(KERN_INFO "Información persistente del nuevo inodo guardada en disco\n");
@@ -327,7 +794,7 @@ static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir ,
      * El nombre se sacará del tercer parámetro
      */ 
     parent_inode_info = dir -> i_private;
-    bh = sb_bread(sb, parent_inode_info -> data_block_number);
+    bh = assoofs_bread(sb, parent_inode_info -> data_block_number);
 
     dir_contents = (struct assoofs_dir_record_entry *) bh -> b_data;
     dir_contents += parent_inode_info -> dir_children_count;
@@ -352,13 +819,292 @@ static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir ,
     return 0;
 }
 
+/*
+ * ASSOOFS_IOC_BULK_CREATE: crea un lote de ficheros regulares en el directorio filp.
+ * Inodos y bloques se reservan de una vez con los cerrojos de todos los grupos, las entradas se añaden
+ * juntas al bloque del directorio y, ya sin esos cerrojos, todos los buffers modificados (datos, directorio,
+ * almacén de inodos y superbloque) se envían a la vez y se esperan una sola vez, en lugar de sincronizar cada uno.
+ */
+static int assoofs_bulk_create(struct file *filp, struct assoofs_bulk_create __user *arg) {
+    struct inode *dir = file_inode(filp);
+    struct super_block *sb = dir -> i_sb;
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    struct assoofs_super_block_info *assoofs_sb = fs_info -> sb_info;
+    struct assoofs_inode_info *parent_inode_info = dir -> i_private;
+    struct assoofs_bulk_create req;
+    struct assoofs_bulk_entry *entries = NULL;
+    struct assoofs_inode_info *infos = NULL;
+    struct assoofs_dir_record_entry *dir_contents;
+    struct assoofs_inode_info *inode_pos;
+    struct dentry **dentries = NULL;
+    struct buffer_head **bhs = NULL;
+    struct buffer_head *bh;
+    struct inode *inode;
+    char **images = NULL;
+    char *data = NULL;
+    uint64_t hash = 0;
+    uint64_t size;
+    size_t len;
+    int dedup = fs_info -> mount_opts & ASSOOFS_MOUNT_DEDUP;
+    int nr_bhs = 0, nr_images = 0;
+    int n, i, j, g, b, clen;
+    int ret;
+
+    printk(KERN_INFO "Bulk create request\n");
+
+    if (!S_ISDIR(parent_inode_info -> mode)) return -ENOTDIR;
+    if (copy_from_user(&req, arg, sizeof(req))) return -EFAULT;
+    if (!req.count) return 0;
+    if (req.count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) return -ENOSPC;
+    n = req.count;
+
+    entries = kcalloc(n, sizeof(*entries), GFP_KERNEL);
+    infos = kcalloc(n, sizeof(*infos), GFP_KERNEL);
+    dentries = kcalloc(n, sizeof(*dentries), GFP_KERNEL);
+    images = kcalloc(n, sizeof(*images), GFP_KERNEL);
+    bhs = kcalloc(n + 3, sizeof(*bhs), GFP_KERNEL); //datos + directorio + almacén de inodos + superbloque
+    data = kmalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+    if (!entries || !infos || !dentries || !images || !bhs || !data) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    if (copy_from_user(entries, u64_to_user_ptr(req.entries), n * sizeof(*entries))) {
+        ret = -EFAULT;
+        goto out_free;
+    }
+
+    /* 1. Validar las entradas y preparar la imagen del bloque de datos de cada fichero, sin cerrojos */
+    for (i = 0; i < n; i++) {
+        len = strnlen(entries[i].filename, ASSOOFS_FILENAME_MAXLEN);
+        if (!len || len == ASSOOFS_FILENAME_MAXLEN || strchr(entries[i].filename, '/') ||
+            !strcmp(entries[i].filename, ".") || !strcmp(entries[i].filename, "..") ||
+            ((entries[i].mode & S_IFMT) && !S_ISREG(entries[i].mode))) {
+            ret = -EINVAL;
+            goto out_free;
+        }
+
+        for (j = 0; j < i; j++) {
+            if (!strcmp(entries[i].filename, entries[j].filename)) {
+                ret = -EEXIST;
+                goto out_free;
+            }
+        }
+
+        infos[i].mode = S_IFREG | (entries[i].mode & S_IALLUGO & ~current_umask());
+        infos[i].flags = assoofs_new_inode_flags(sb, parent_inode_info);
+        infos[i].remove_flag = NO_REMOVED;
+        infos[i].data_block_number = ASSOOFS_NO_BLOCK;
+
+        size = entries[i].size;
+        if (size > assoofs_max_file_size(&infos[i])) {
+            ret = -EFBIG;
+            goto out_free;
+        }
+        if (copy_from_user(data, u64_to_user_ptr(entries[i].data), size)) {
+            ret = -EFAULT;
+            goto out_free;
+        }
+        infos[i].file_size = size;
+
+        if (!memchr_inv(data, 0, size)) continue; //Vacío o todo ceros: hueco, sin bloque
+
+        images[i] = kmalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+        if (!images[i]) {
+            ret = -ENOMEM;
+            goto out_free;
+        }
+        ret = assoofs_make_block_image(&infos[i], data, size, images[i], &clen);
+        if (ret) goto out_free;
+        infos[i].disk_size = clen;
+        nr_images++;
+    }
+
+    ret = mnt_want_write_file(filp);
+    if (ret) goto out_free;
+    inode_lock_nested(dir, I_MUTEX_PARENT);
+
+    /* 2. Mismas comprobaciones que hace la VFS antes de create (may_create): el fd puede estar abierto sólo para lectura */
+    if (IS_DEADDIR(dir)) {
+        ret = -ENOENT;
+        goto out_unlock;
+    }
+    if (!fsuidgid_has_mapping(sb, file_mnt_user_ns(filp))) {
+        ret = -EOVERFLOW;
+        goto out_unlock;
+    }
+    ret = inode_permission(file_mnt_user_ns(filp), dir, MAY_WRITE | MAY_EXEC);
+    if (ret) goto out_unlock;
+
+    //Comprobar que los nombres no existen y que caben en el bloque del directorio
+    if (parent_inode_info -> dir_children_count + n > ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry)) {
+        ret = -ENOSPC;
+        goto out_unlock;
+    }
+
+    for (i = 0; i < n; i++) {
+        dentries[i] = lookup_one_len(entries[i].filename, filp -> f_path.dentry, strlen(entries[i].filename));
+        if (IS_ERR(dentries[i])) {
+            ret = PTR_ERR(dentries[i]);
+            dentries[i] = NULL;
+            goto out_unlock;
+        }
+        if (d_really_is_positive(dentries[i])) {
+            ret = -EEXIST;
+            goto out_unlock;
+        }
+        ret = security_inode_create(dir, dentries[i], infos[i].mode);
+        if (ret) goto out_unlock;
+    }
+
+    /* 3. Reservar todos los inodos y bloques del lote con los cerrojos de todos los grupos */
+    assoofs_lock_all_groups(sb);
+    mutex_lock(&fs_info -> inode_store_lock);
+
+    if (hweight64(assoofs_sb -> free_inodes) < n || hweight64(assoofs_sb -> free_blocks & ~fs_info -> discard_busy) < nr_images) {
+        ret = -ENOSPC;
+        goto out_unlock_groups;
+    }
+
+    g = assoofs_inode_group(parent_inode_info -> inode_no);
+    for (i = 0; i < n; i++) {
+        //Los ficheros van al grupo del directorio padre (o al siguiente con sitio)
+        for (j = 0; (b = __assoofs_group_alloc_inode(sb, (g + j) % ASSOOFS_GROUP_COUNT)) < 0; j++);
+        infos[i].inode_no = b;
+
+        if (!images[i]) continue;
+
+        if (dedup) {
+            hash = xxh64(images[i], ASSOOFS_DEFAULT_BLOCK_SIZE, 0);
+            for (j = 0, b = -1; b < 0 && j < ASSOOFS_GROUP_COUNT; j++)
+                b = __assoofs_dedup_find(sb, j, images[i], hash);
+
+            if (b >= 0) {
+                assoofs_sb -> block_refcount[b]++;
+                infos[i].data_block_number = b;
+                continue;
+            }
+        }
+
+        for (j = 0; (b = __assoofs_group_alloc_block(sb, (assoofs_inode_group(infos[i].inode_no) + j) % ASSOOFS_GROUP_COUNT)) < 0; j++);
+        infos[i].data_block_number = b;
+
+        bh = assoofs_getblk(sb, b);
+        lock_buffer(bh);
+        memcpy(bh -> b_data, images[i], ASSOOFS_DEFAULT_BLOCK_SIZE);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        bhs[nr_bhs++] = bh;
+
+        if (dedup) {
+            assoofs_sb -> block_hash[b] = hash;
+            set_bit(b, (unsigned long *) &assoofs_sb -> hashed_blocks);
+        }
+    }
+
+    /* 4. Añadir todas las entradas al bloque del directorio padre */
+    bh = assoofs_bread(sb, parent_inode_info -> data_block_number);
+    dir_contents = (struct assoofs_dir_record_entry *) bh -> b_data;
+    dir_contents += parent_inode_info -> dir_children_count;
+    for (i = 0; i < n; i++, dir_contents++) {
+        strcpy(dir_contents -> filename, entries[i].filename);
+        dir_contents -> inode_no = infos[i].inode_no;
+        dir_contents -> remove_flag = NO_REMOVED;
+    }
+    mark_buffer_dirty(bh);
+    bhs[nr_bhs++] = bh;
+    parent_inode_info -> dir_children_count += n;
+
+    /* 5. Añadir los inodos al final del almacén y actualizar el padre */
+    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    memcpy((struct assoofs_inode_info *) bh -> b_data + assoofs_sb -> inodes_count, infos, n * sizeof(*infos));
+    assoofs_sb -> inodes_count += n;
+    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *) bh -> b_data, parent_inode_info);
+    memcpy(inode_pos, parent_inode_info, sizeof(*inode_pos));
+    mark_buffer_dirty(bh);
+    bhs[nr_bhs++] = bh;
+
+    mark_buffer_dirty(fs_info -> bh);
+    bhs[nr_bhs++] = get_bh(fs_info -> bh);
+
+    mutex_unlock(&fs_info -> inode_store_lock);
+    assoofs_unlock_all_groups(sb);
+
+    /*
+     * 6. Única escritura, ya sin los cerrojos de los grupos ni del almacén: la reserva está hecha y los buffers
+     * sucios, así que el resto de asignaciones no espera por esta E/S. Si otra operación escribe antes el almacén
+     * o el superbloque, sus cambios van juntos. Sólo se mantiene bloqueado el directorio padre.
+     */
+    for (i = 0; i < nr_bhs; i++)
+        write_dirty_buffer(bhs[i], REQ_SYNC);
+    for (i = 0; i < nr_bhs; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i])) ret = -EIO;
+        brelse(bhs[i]);
+    }
+
+    /* 7. Crear los inodos en memoria y asociarlos a sus dentries */
+    for (i = 0; i < n; i++) {
+        entries[i].inode_no = infos[i].inode_no;
+
+        inode = new_inode(sb);
+        if (!inode) {
+            d_drop(dentries[i]); //Se encontrará en disco en el próximo lookup
+            continue;
+        }
+        inode -> i_ino = infos[i].inode_no;
+        inode -> i_op = &assoofs_inode_ops;
+        inode -> i_fop = &assoofs_file_operations;
+        inode -> i_atime = inode -> i_mtime = inode -> i_ctime = current_time(inode);
+        inode -> i_private = kmemdup(&infos[i], sizeof(infos[i]), GFP_KERNEL);
+        if (!inode -> i_private) {
+            iput(inode);
+            d_drop(dentries[i]);
+            continue;
+        }
+        inode_init_owner(file_mnt_user_ns(filp), inode, dir, infos[i].mode);
+        i_size_write(inode, infos[i].file_size);
+
+        if (d_unhashed(dentries[i]))
+            d_add(dentries[i], inode);
+        else
+            d_instantiate(dentries[i], inode);
+        fsnotify_create(dir, dentries[i]);
+    }
+    dir -> i_mtime = dir -> i_ctime = current_time(dir);
+
+    if (copy_to_user(u64_to_user_ptr(req.entries), entries, n * sizeof(*entries))) ret = -EFAULT;
+    goto out_unlock;
+
+out_unlock_groups:
+    mutex_unlock(&fs_info -> inode_store_lock);
+    assoofs_unlock_all_groups(sb);
+out_unlock:
+    for (i = 0; i < n; i++)
+        if (dentries[i]) dput(dentries[i]);
+    inode_unlock(dir);
+    mnt_drop_write_file(filp);
+out_free:
+    if (images)
+        for (i = 0; i < n; i++) kfree(images[i]);
+    kfree(images);
+    kfree(entries);
+    kfree(infos);
+    kfree(dentries);
+    kfree(bhs);
+    kfree(data);
+
+    return ret;
+}
+
 /*
  *  FUNCIONES AUXILIARES
  */
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no) {
     struct assoofs_inode_info *inode_info = NULL;
     struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb = sb -> s_fs_info;
+    struct assoofs_super_block_info *afs_sb = assoofs_get_sb_info(sb);
     struct assoofs_inode_info *buffer = NULL;
     int i;
 
@@ -379,6 +1125,266 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
     return buffer;
 }
 
+//Flags con los que nace un inodo: se heredan del directorio padre y de las opciones de montaje
+static uint64_t assoofs_new_inode_flags(struct super_block *sb, struct assoofs_inode_info *parent_inode_info) {
+    uint64_t flags = parent_inode_info -> flags & ASSOOFS_INODE_COMPRESSED;
+
+    if (assoofs_get_fs_info(sb) -> mount_opts & ASSOOFS_MOUNT_COMPRESS)
+        flags |= ASSOOFS_INODE_COMPRESSED;
+
+    return flags;
+}
+
+/*
+ * Tamaño máximo de un fichero: un bloque en bruto, o un cluster si se comprime. Es sólo una cota: si el
+ * cluster no se comprime lo bastante se guarda en bruto y la escritura se queda en un bloque.
+ */
+static uint64_t assoofs_max_file_size(struct assoofs_inode_info *inode_info) {
+    return (inode_info -> flags & ASSOOFS_INODE_COMPRESSED) ? ASSOOFS_CLUSTER_SIZE : ASSOOFS_DEFAULT_BLOCK_SIZE;
+}
+
+/*
+ * Lee el contenido lógico de un fichero en data (ASSOOFS_CLUSTER_SIZE bytes).
+ * Si el cluster está comprimido (disk_size != 0) se descomprime con LZ4.
+ */
+static int assoofs_read_data(struct super_block *sb, struct assoofs_inode_info *inode_info, char *data) {
+    struct buffer_head *bh;
+    int ret = 0;
+
+    if (!inode_info -> file_size) return 0;
+
+    if (inode_info -> data_block_number == ASSOOFS_NO_BLOCK) { //Hueco
+        memset(data, 0, inode_info -> file_size);
+        return 0;
+    }
+
+    bh = assoofs_bread(sb, inode_info -> data_block_number);
+    if (!bh) return -EIO;
+
+    if (inode_info -> disk_size) {
+        if (LZ4_decompress_safe(bh -> b_data, data, inode_info -> disk_size, ASSOOFS_CLUSTER_SIZE) != inode_info -> file_size) {
+            printk(KERN_ERR "Corrupted compressed cluster in block %llu\n", inode_info -> data_block_number);
+            ret = -EIO;
+        }
+    } else {
+        memcpy(data, bh -> b_data, min_t(uint64_t, inode_info -> file_size, ASSOOFS_DEFAULT_BLOCK_SIZE));
+    }
+
+    brelse(bh);
+
+    return ret;
+}
+
+/*
+ * Guarda size bytes de data en el bloque de datos del fichero y actualiza su información persistente.
+ * Si el inodo tiene ASSOOFS_INODE_COMPRESSED se intenta comprimir el cluster con LZ4; si no reduce
+ * el tamaño (cluster incompresible) se guarda sin comprimir, siempre que quepa en un bloque.
+ */
+static int assoofs_write_data(struct super_block *sb, struct assoofs_inode_info *inode_info, const char *data, uint64_t size) {
+    char *block_data;
+    int clen;
+    int ret;
+
+    //Contenido todo a ceros: no hace falta bloque, el fichero queda como un hueco
+    if (!memchr_inv(data, 0, size)) {
+        assoofs_release_block(sb, inode_info);
+        inode_info -> file_size = size;
+        inode_info -> disk_size = 0;
+        assoofs_save_inode_info(sb, inode_info);
+
+        return 0;
+    }
+
+    block_data = kmalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+    if (!block_data) return -ENOMEM;
+
+    ret = assoofs_make_block_image(inode_info, data, size, block_data, &clen);
+    if (!ret) ret = assoofs_store_block(sb, inode_info, block_data);
+    kfree(block_data);
+    if (ret) return ret;
+
+    inode_info -> file_size = size;
+    inode_info -> disk_size = clen;
+    assoofs_save_inode_info(sb, inode_info);
+
+    return 0;
+}
+
+/*
+ * Construye en block_data la imagen completa del bloque de datos (comprimida o no), rellena con ceros
+ * para que bloques con el mismo contenido sean idénticos. En clen deja los bytes comprimidos (0 = en bruto).
+ */
+static int assoofs_make_block_image(struct assoofs_inode_info *inode_info, const char *data, uint64_t size, char *block_data, int *clen) {
+    void *wrkmem;
+
+    *clen = 0;
+    memset(block_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+
+    if (inode_info -> flags & ASSOOFS_INODE_COMPRESSED) {
+        wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (!wrkmem) return -ENOMEM;
+
+        *clen = LZ4_compress_default(data, block_data, size, ASSOOFS_DEFAULT_BLOCK_SIZE, wrkmem);
+        kvfree(wrkmem);
+
+        if (*clen <= 0 || *clen >= size) *clen = 0; //Incompresible: se guarda en bruto
+    }
+
+    if (!*clen) {
+        if (size > ASSOOFS_DEFAULT_BLOCK_SIZE) return -EFBIG;
+
+        memset(block_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        memcpy(block_data, data, size);
+    }
+
+    return 0;
+}
+
+/*
+ * Escribe la imagen de un bloque de datos del inodo.
+ * Con la opción "dedup", si ya hay un bloque con el mismo contenido se comparte (se incrementa su
+ * contador de referencias) en lugar de escribirlo. Si el bloque actual del inodo está compartido
+ * se hace copia en escritura sobre un bloque nuevo. El llamante guarda la información del inodo.
+ */
+static int assoofs_store_block(struct super_block *sb, struct assoofs_inode_info *inode_info, const char *block_data) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    struct assoofs_super_block_info *assoofs_sb = fs_info -> sb_info;
+    uint64_t block = inode_info -> data_block_number;
+    uint64_t new_block;
+    uint64_t hash = 0;
+    int dedup = fs_info -> mount_opts & ASSOOFS_MOUNT_DEDUP;
+    int group;
+    int ret;
+
+    if (dedup) {
+        hash = xxh64(block_data, ASSOOFS_DEFAULT_BLOCK_SIZE, 0);
+
+        //Si el bloque encontrado es el propio, la referencia tomada y la soltada se compensan
+        if (!assoofs_dedup_get_block(sb, block_data, hash, &new_block)) {
+            assoofs_sb_put_block(sb, block);
+            inode_info -> data_block_number = new_block;
+
+            return 0;
+        }
+    }
+
+    //El bloque es sólo de este inodo: se sobrescribe en su sitio
+    if (block != ASSOOFS_NO_BLOCK) {
+        group = assoofs_block_group(block);
+        mutex_lock(&fs_info -> group_lock[group]);
+
+        if (assoofs_sb -> block_refcount[block] == 1) {
+            assoofs_write_block(sb, block, block_data);
+
+            //El contenido del bloque ha cambiado: actualizar (o retirar) su entrada del índice
+            if (dedup) {
+                assoofs_sb -> block_hash[block] = hash;
+                set_bit(block, (unsigned long *) &assoofs_sb -> hashed_blocks);
+                assoofs_dirty_sb_info(sb);
+            } else if (test_and_clear_bit(block, (unsigned long *) &assoofs_sb -> hashed_blocks)) {
+                assoofs_dirty_sb_info(sb);
+            }
+
+            mutex_unlock(&fs_info -> group_lock[group]);
+            assoofs_sync_sb_info(sb);
+            return 0;
+        }
+
+        mutex_unlock(&fs_info -> group_lock[group]);
+    }
+
+    //Asignación en la primera escritura (fichero disperso) o copia en escritura si otros inodos siguen apuntando al bloque actual
+    ret = assoofs_sb_get_a_freeblock(sb, assoofs_inode_group(inode_info -> inode_no), &new_block);
+    if (ret) return ret;
+
+    group = assoofs_block_group(new_block);
+    mutex_lock(&fs_info -> group_lock[group]);
+    assoofs_write_block(sb, new_block, block_data);
+    if (dedup) {
+        assoofs_sb -> block_hash[new_block] = hash;
+        set_bit(new_block, (unsigned long *) &assoofs_sb -> hashed_blocks);
+        assoofs_dirty_sb_info(sb);
+    }
+    mutex_unlock(&fs_info -> group_lock[group]);
+    assoofs_sync_sb_info(sb);
+
+    assoofs_sb_put_block(sb, block);
+    inode_info -> data_block_number = new_block;
+
+    return 0;
+}
+
+//Se sobrescribe el bloque entero, no hace falta leerlo antes de disco
+static void assoofs_write_block(struct super_block *sb, uint64_t block, const char *block_data) {
+    struct buffer_head *bh;
+
+    bh = assoofs_getblk(sb, block);
+    lock_buffer(bh);
+    memcpy(bh -> b_data, block_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+}
+
+//Deja al inodo sin bloque de datos (hueco). El llamante guarda la información del inodo
+static void assoofs_release_block(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+    assoofs_sb_put_block(sb, inode_info -> data_block_number);
+    inode_info -> data_block_number = ASSOOFS_NO_BLOCK;
+}
+
+/*
+ * Busca en el índice un bloque con el mismo contenido que block_data y, si lo hay, toma una referencia.
+ * El hash sólo preselecciona, se compara el bloque entero. Cada grupo se recorre con su cerrojo cogido.
+ */
+static int assoofs_dedup_get_block(struct super_block *sb, const char *block_data, uint64_t hash, uint64_t *block) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int g;
+    int i;
+
+    for (g = 0; g < ASSOOFS_GROUP_COUNT; g++) {
+        mutex_lock(&fs_info -> group_lock[g]);
+
+        i = __assoofs_dedup_find(sb, g, block_data, hash);
+        if (i >= 0) {
+            fs_info -> sb_info -> block_refcount[i]++;
+            assoofs_dirty_sb_info(sb);
+            mutex_unlock(&fs_info -> group_lock[g]);
+            assoofs_sync_sb_info(sb);
+
+            *block = i;
+            return 0;
+        }
+
+        mutex_unlock(&fs_info -> group_lock[g]);
+    }
+
+    return -ENOENT;
+}
+
+//Bloque del grupo g cuyo contenido es block_data, o -1. Requiere el cerrojo del grupo
+static int __assoofs_dedup_find(struct super_block *sb, int g, const char *block_data, uint64_t hash) {
+    struct assoofs_super_block_info *assoofs_sb = assoofs_get_sb_info(sb);
+    struct buffer_head *bh;
+    int match;
+    int i;
+
+    for (i = g * ASSOOFS_BLOCKS_PER_GROUP; i < (g + 1) * ASSOOFS_BLOCKS_PER_GROUP; i++) {
+        if (!test_bit(i, (unsigned long *) &assoofs_sb -> hashed_blocks) || assoofs_sb -> block_hash[i] != hash)
+            continue;
+
+        bh = assoofs_bread(sb, i);
+        if (!bh) continue;
+        match = !memcmp(bh -> b_data, block_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        brelse(bh);
+
+        if (match) return i;
+    }
+
+    return -1;
+}
+
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino) {
     /* 1. Obtener la información persistente del inodo ino. Ver la función auxiliar assoofs_get_inode_info descrita anteriormente */
     struct inode *inode;
@@ -395,6 +1401,7 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino) {
         inode -> i_fop = &assoofs_dir_operations;
     } else if (S_ISREG(inode_info -> mode)) {
         inode -> i_fop = &assoofs_file_operations;
+        i_size_write(inode, inode_info -> file_size); //La VFS lo usa para validar rangos (p. ej. FIDEDUPERANGE)
     } else {
         printk(KERN_ERR "Unknown inode type. Neither a directory nor a file");
     }
@@ -408,38 +1415,342 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino) {
     
 }
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block) {
+/*
+ * Busca un bloque libre empezando por el grupo de asignación indicado; si está lleno se prueba con los siguientes.
+ * Cada grupo se recorre con su propio cerrojo, así que las asignaciones en grupos distintos no compiten entre sí.
+ */
+int assoofs_sb_get_a_freeblock(struct super_block *sb, int group, uint64_t *block) {
 
     //Obtenemos la información persistente del superbloque que previamente habiamos guardado en s_fs_info
-    struct assoofs_super_block_info *assoofs_sb = sb -> s_fs_info;
-    //Recorremos el mapa de bit en busca de un bloque libre (bit = 1)
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int g, i;
+
+    for (g = 0; g < ASSOOFS_GROUP_COUNT; g++) {
+        group = (group + (g ? 1 : 0)) % ASSOOFS_GROUP_COUNT;
+
+        mutex_lock(&fs_info -> group_lock[group]);
+
+        i = __assoofs_group_alloc_block(sb, group);
+        if (i >= 0) {
+            *block = i;
+            //Hay que guardar los cambios en el superbloque
+            assoofs_dirty_sb_info(sb);
+            mutex_unlock(&fs_info -> group_lock[group]);
+            assoofs_sync_sb_info(sb);
+
+            return 0; //Devuelve 0 si todo va bien
+        }
+
+        mutex_unlock(&fs_info -> group_lock[group]);
+    }
+
+    printk(KERN_ERR "No free blocks left in the bit map\n");
+
+    return -ENOSPC;
+}
+
+//Toma el primer bloque libre del grupo g, o devuelve -1. Requiere el cerrojo del grupo, el llamante guarda el superbloque
+static int __assoofs_group_alloc_block(struct super_block *sb, int g) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    struct assoofs_super_block_info *assoofs_sb = fs_info -> sb_info;
+    uint64_t avail = assoofs_sb -> free_blocks & ~fs_info -> discard_busy; //Los bloques que se están descartando no se pueden asignar todavía
+    int first = max(g * ASSOOFS_BLOCKS_PER_GROUP, ASSOOFS_INODESTORE_BLOCK_NUMBER + 1); //(Bloque 0 = sb, Bloque 1 = almacen de inodos)
     int i;
 
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++) //Empiezo desde el 2 (Bloque 0 = sb, Bloque 1 = almacen de inodos)
-        if (assoofs_sb -> free_blocks & (1 << i)) //Operacion binaria que comprueba si el bit correspondiente a la iteracion esta disponible o no (valor > 0 = disponible)
-            break; //cuando aparece el primer bit 1 en free_block dejamos de recorres le mapa de bits, i tiene la posicion del primer bloque libre 
+    //Recorremos el mapa de bits del grupo en busca de un bloque libre (bit = 1)
+    i = find_next_bit((unsigned long *) &avail, (g + 1) * ASSOOFS_BLOCKS_PER_GROUP, first);
+    if (i >= (g + 1) * ASSOOFS_BLOCKS_PER_GROUP) return -1;
 
-    *block = i;
-    //Hay que actualizar el valor de free_blocks y guardar los cambios en el superbloque
-    assoofs_sb -> free_blocks &= ~(1 << i);
-    assoofs_save_sb_info(sb);
+    //Hay que actualizar el valor de free_blocks
+    clear_bit(i, (unsigned long *) &assoofs_sb -> free_blocks);
+    clear_bit(i, (unsigned long *) &assoofs_sb -> hashed_blocks);
+    assoofs_sb -> block_refcount[i] = 1;
 
-    return 0; //Devuelve 0 si todo va bien
+    return i;
+}
+
+//Igual que assoofs_sb_get_a_freeblock pero con el mapa de inodos libres. Los inodos del grupo g son g * ASSOOFS_INODES_PER_GROUP + 1 ...
+int assoofs_sb_get_a_freeinode(struct super_block *sb, int group, uint64_t *inode_no) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int g, i;
+
+    for (g = 0; g < ASSOOFS_GROUP_COUNT; g++) {
+        group = (group + (g ? 1 : 0)) % ASSOOFS_GROUP_COUNT;
+
+        mutex_lock(&fs_info -> group_lock[group]);
+
+        i = __assoofs_group_alloc_inode(sb, group);
+        if (i >= 0) {
+            *inode_no = i;
+            assoofs_dirty_sb_info(sb);
+            mutex_unlock(&fs_info -> group_lock[group]);
+            assoofs_sync_sb_info(sb);
+
+            return 0;
+        }
+
+        mutex_unlock(&fs_info -> group_lock[group]);
+    }
+
+    return -ENOSPC;
+}
+
+//Devuelve al mapa de inodos libres un inodo que no ha llegado a usarse
+static void assoofs_sb_put_inode(struct super_block *sb, uint64_t inode_no) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int group = assoofs_inode_group(inode_no);
+
+    mutex_lock(&fs_info -> group_lock[group]);
+    set_bit(inode_no - 1, (unsigned long *) &fs_info -> sb_info -> free_inodes);
+    assoofs_dirty_sb_info(sb);
+    mutex_unlock(&fs_info -> group_lock[group]);
+    assoofs_sync_sb_info(sb);
+}
+
+//Toma el primer inodo libre del grupo g y devuelve su número, o -1. Requiere el cerrojo del grupo, el llamante guarda el superbloque
+static int __assoofs_group_alloc_inode(struct super_block *sb, int g) {
+    struct assoofs_super_block_info *assoofs_sb = assoofs_get_sb_info(sb);
+    int i;
+
+    i = find_next_bit((unsigned long *) &assoofs_sb -> free_inodes, (g + 1) * ASSOOFS_INODES_PER_GROUP, g * ASSOOFS_INODES_PER_GROUP);
+    if (i >= (g + 1) * ASSOOFS_INODES_PER_GROUP) return -1;
+
+    clear_bit(i, (unsigned long *) &assoofs_sb -> free_inodes);
+
+    return i + 1;
+}
+
+//Grupo para un directorio nuevo: el que tenga más bloques libres entre los que aún tienen inodos libres
+static int assoofs_find_dir_group(struct super_block *sb) {
+    struct assoofs_super_block_info *assoofs_sb = assoofs_get_sb_info(sb);
+    uint64_t blocks_mask = (1ULL << ASSOOFS_BLOCKS_PER_GROUP) - 1;
+    uint64_t inodes_mask = (1ULL << ASSOOFS_INODES_PER_GROUP) - 1;
+    int best = 0, best_free = -1, free;
+    int g;
+
+    //Lectura sin cerrojos: es sólo una heurística, la asignación real se hace con el cerrojo del grupo
+    for (g = 0; g < ASSOOFS_GROUP_COUNT; g++) {
+        if (!((READ_ONCE(assoofs_sb -> free_inodes) >> (g * ASSOOFS_INODES_PER_GROUP)) & inodes_mask))
+            continue;
+
+        free = hweight64((READ_ONCE(assoofs_sb -> free_blocks) >> (g * ASSOOFS_BLOCKS_PER_GROUP)) & blocks_mask);
+        if (free > best_free) {
+            best = g;
+            best_free = free;
+        }
+    }
+
+    return best;
+}
+
+//Toma una referencia más sobre un bloque ya asignado (bloques compartidos)
+static void assoofs_sb_get_block(struct super_block *sb, uint64_t block) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int group = assoofs_block_group(block);
+
+    if (block == ASSOOFS_NO_BLOCK) return;
+
+    mutex_lock(&fs_info -> group_lock[group]);
+    fs_info -> sb_info -> block_refcount[block]++;
+    assoofs_dirty_sb_info(sb);
+    mutex_unlock(&fs_info -> group_lock[group]);
+    assoofs_sync_sb_info(sb);
+}
+
+static void assoofs_sb_put_block(struct super_block *sb, uint64_t block) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int group = assoofs_block_group(block);
+
+    if (block == ASSOOFS_NO_BLOCK) return;
+
+    mutex_lock(&fs_info -> group_lock[group]);
+    __assoofs_sb_put_block(sb, block);
+    assoofs_dirty_sb_info(sb);
+    mutex_unlock(&fs_info -> group_lock[group]);
+    assoofs_sync_sb_info(sb);
+}
+
+//Suelta una referencia a un bloque; cuando no quedan se devuelve al mapa de bits. Requiere el cerrojo de su grupo, el llamante guarda el superbloque
+static void __assoofs_sb_put_block(struct super_block *sb, uint64_t block) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    struct assoofs_super_block_info *assoofs_sb = fs_info -> sb_info;
+
+    if (block == ASSOOFS_NO_BLOCK) return;
+
+    if (assoofs_sb -> block_refcount[block] > 1) {
+        assoofs_sb -> block_refcount[block]--;
+        return;
+    }
+
+    assoofs_sb -> block_refcount[block] = 0;
+    set_bit(block, (unsigned long *) &assoofs_sb -> free_blocks);
+    clear_bit(block, (unsigned long *) &assoofs_sb -> hashed_blocks);
+
+    //Opción "discard": el bloque se descarta más tarde, junto con el resto de los liberados en la misma ventana
+    if (fs_info -> mount_opts & ASSOOFS_MOUNT_DISCARD) {
+        set_bit(block, (unsigned long *) &fs_info -> discard_pending);
+        schedule_delayed_work(&fs_info -> discard_work, ASSOOFS_DISCARD_DELAY);
+    }
+}
+
+//Cerrojos de todos los grupos, siempre en orden creciente
+static void assoofs_lock_all_groups(struct super_block *sb) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int g;
+
+    for (g = 0; g < ASSOOFS_GROUP_COUNT; g++)
+        mutex_lock(&fs_info -> group_lock[g]);
+}
+
+static void assoofs_unlock_all_groups(struct super_block *sb) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int g;
+
+    for (g = ASSOOFS_GROUP_COUNT - 1; g >= 0; g--)
+        mutex_unlock(&fs_info -> group_lock[g]);
+}
+
+/*
+ * Descarta los bloques de candidates que siguen libres, fusionando los contiguos en un único discard
+ * por tramo (si el tramo tiene al menos minlen bloques). Los tramos elegidos se marcan como ocupados
+ * (discard_busy) con los cerrojos de todos los grupos y se liberan antes de lanzar el discard, para
+ * que el resto de asignaciones y escrituras no esperen a que termine la E/S.
+ */
+static int assoofs_trim_free_blocks(struct super_block *sb, uint64_t candidates, uint64_t minlen, uint64_t *trimmed) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    uint64_t free;
+    uint64_t discard = 0;
+    unsigned long start = 0, end;
+    int ret;
+
+    assoofs_lock_all_groups(sb);
+
+    //Un bloque ya ocupado por otro descarte en curso no se vuelve a coger
+    free = fs_info -> sb_info -> free_blocks & candidates & ~fs_info -> discard_busy;
+    for (;;) {
+        start = find_next_bit((unsigned long *) &free, ASSOOFS_BLOCK_MAP_SIZE, start);
+        if (start >= ASSOOFS_BLOCK_MAP_SIZE) break;
+        end = find_next_zero_bit((unsigned long *) &free, ASSOOFS_BLOCK_MAP_SIZE, start);
+
+        if (end - start >= minlen) {
+            discard |= GENMASK_ULL(end - 1, start);
+            *trimmed += end - start;
+        }
+
+        start = end;
+    }
+    fs_info -> discard_busy |= discard;
+
+    assoofs_unlock_all_groups(sb);
+
+    if (!discard) return 0;
+
+    ret = assoofs_issue_discard(sb, discard);
+    if (ret) *trimmed = 0;
+
+    //Los bloques descartados vuelven a estar disponibles
+    assoofs_lock_all_groups(sb);
+    fs_info -> discard_busy &= ~discard;
+    assoofs_unlock_all_groups(sb);
+
+    return ret;
+}
+
+/*
+ * Descarta los bloques lógicos de blocks. En cada dispositivo se fusionan los bloques físicos contiguos
+ * en un único discard, y todas las bios (de todos los miembros) se encadenan para lanzarlas en paralelo
+ * y esperar una sola vez.
+ */
+static int assoofs_issue_discard(struct super_block *sb, uint64_t blocks) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    sector_t run_start[ASSOOFS_MAX_DEVICES];
+    sector_t run_len[ASSOOFS_MAX_DEVICES] = { 0 };
+    struct block_device *bdev;
+    struct bio *bio = NULL;
+    struct blk_plug plug;
+    sector_t phys;
+    unsigned long i;
+    int d, ret = 0, err;
+
+    blk_start_plug(&plug);
+
+    for_each_set_bit(i, (unsigned long *) &blocks, ASSOOFS_BLOCK_MAP_SIZE) {
+        bdev = assoofs_map_block(sb, i, &phys);
+        for (d = 0; fs_info -> bdev[d] != bdev; d++);
+
+        if (run_len[d] && run_start[d] + run_len[d] == phys) {
+            run_len[d]++;
+            continue;
+        }
+
+        if (run_len[d]) {
+            ret = __blkdev_issue_discard(bdev, run_start[d] * ASSOOFS_BLOCK_SECTORS, run_len[d] * ASSOOFS_BLOCK_SECTORS, GFP_NOFS, 0, &bio);
+            if (ret) break;
+        }
+        run_start[d] = phys;
+        run_len[d] = 1;
+    }
+
+    for (d = 0; !ret && d < fs_info -> nr_devices; d++) {
+        if (run_len[d])
+            ret = __blkdev_issue_discard(fs_info -> bdev[d], run_start[d] * ASSOOFS_BLOCK_SECTORS, run_len[d] * ASSOOFS_BLOCK_SECTORS, GFP_NOFS, 0, &bio);
+    }
+
+    if (bio) {
+        err = submit_bio_wait(bio);
+        if (!ret && err != -EOPNOTSUPP) ret = err;
+        bio_put(bio);
+    }
+
+    blk_finish_plug(&plug);
+
+    return ret;
+}
+
+static int assoofs_discard_supported(struct super_block *sb) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+    int d;
+
+    for (d = 0; d < fs_info -> nr_devices; d++)
+        if (!blk_queue_discard(bdev_get_queue(fs_info -> bdev[d])))
+            return 0;
+
+    return 1;
+}
+
+//Descarte en línea: se ejecuta en segundo plano al acabar la ventana ASSOOFS_DISCARD_DELAY
+static void assoofs_discard_worker(struct work_struct *work) {
+    struct assoofs_fs_info *fs_info = container_of(to_delayed_work(work), struct assoofs_fs_info, discard_work);
+    uint64_t trimmed = 0;
+    uint64_t pending;
+
+    assoofs_lock_all_groups(fs_info -> sb);
+    pending = fs_info -> discard_pending;
+    fs_info -> discard_pending = 0;
+    assoofs_unlock_all_groups(fs_info -> sb);
+
+    if (pending && assoofs_trim_free_blocks(fs_info -> sb, pending, 1, &trimmed))
+        printk(KERN_ERR "assoofs online discard failed\n");
 }
 
 //Permite actualizar la información persistente del superbloque cuando hay un cambio
 void assoofs_save_sb_info(struct super_block *vsb) {
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *sb = vsb -> s_fs_info; //Informacion persistente del superbloque
+    assoofs_dirty_sb_info(vsb);
+    assoofs_sync_sb_info(vsb);
+}
 
-    //Leer de disco la informacion persistente del superbloque sb_bread u sobreescribir el campo b_data con la informacion en memoria
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh -> b_data = (char *)sb; //Sobreescribo los datos de disco con la información en memoria
+/*
+ * Con el cerrojo de un grupo cogido sólo se marca el superbloque como sucio; la escritura síncrona se hace
+ * después de soltarlo con assoofs_sync_sb_info. Así los grupos no se esperan unos a otros por la E/S, y
+ * si varios cambios coinciden se escriben juntos (si el buffer ya está limpio no se escribe de nuevo).
+ */
+static void assoofs_dirty_sb_info(struct super_block *sb) {
+    //La informacion persistente del superbloque vive en el propio buffer del bloque 0, que se mantiene desde el montaje
+    mark_buffer_dirty(assoofs_get_fs_info(sb) -> bh);
+}
 
-    //Marcar el buffer como sucio y sincronizar para que el cambio pase a disco
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+static void assoofs_sync_sb_info(struct super_block *sb) {
+    sync_dirty_buffer(assoofs_get_fs_info(sb) -> bh);
 }
 
 //Permitirá guardar en disco la información persistente de un inodo nuevo
@@ -447,10 +1758,11 @@ void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     uint64_t count;
     struct buffer_head *bh;
     struct assoofs_inode_info *inode_info;
-    struct assoofs_super_block_info *assoofs_sb = sb -> s_fs_info;
+    struct assoofs_super_block_info *assoofs_sb = assoofs_get_sb_info(sb);
 
     //Acceder a la info persistente del superbloque para obtener el contador de inodos
-    count = ((struct assoofs_super_block_info *) sb -> s_fs_info) -> inodes_count;
+    mutex_lock(&assoofs_get_fs_info(sb) -> inode_store_lock);
+    count = assoofs_get_sb_info(sb) -> inodes_count;
 
     //Leer de disco el bloque que contiene el almacén de inodos
     bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); //Bloque 1: almacen de inodos
@@ -464,10 +1776,12 @@ void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
 
+    brelse(bh);
+
     //Actualizar el contador de inodos de la información persistente del superbloque y guardar los cambios
     assoofs_sb -> inodes_count++;
     assoofs_save_sb_info(sb);
-    
+    mutex_unlock(&assoofs_get_fs_info(sb) -> inode_store_lock);
 }
 
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info) {
@@ -494,7 +1808,7 @@ struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, str
     //Recorrer el almacen de inodos, desde start, que marca el ppo del almacen, hasta encontrar los datos del inodo search o hasta el final del almacen
     uint64_t count = 0;
 
-    while (start -> inode_no != search -> inode_no && count < ((struct assoofs_super_block_info *)sb -> s_fs_info)-> inodes_count) {
+    while (start -> inode_no != search -> inode_no && count < assoofs_get_sb_info(sb) -> inodes_count) {
         count++;
         start++;
     }
@@ -508,20 +1822,167 @@ struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, str
 /*
  *  Operaciones sobre el superbloque
  */
+/*
+ *  Dispositivos del volumen: el principal lo abre mount_bdev, el resto se abren aquí
+ */
+static int assoofs_open_devices(struct super_block *sb, struct assoofs_fs_info *fs_info) {
+    struct block_device *bdev;
+    char *paths = fs_info -> device_paths;
+    char *p;
+    int n = 1;
+    int ret;
+
+    fs_info -> bdev[0] = sb -> s_bdev;
+    fs_info -> nr_devices = max_t(uint64_t, fs_info -> sb_info -> nr_devices, 1);
+    fs_info -> stripe_unit = max_t(uint64_t, fs_info -> sb_info -> stripe_unit, 1);
+
+    if (fs_info -> nr_devices > ASSOOFS_MAX_DEVICES) {
+        printk(KERN_ERR "ASSOOFS volume with %d devices, at most %d are supported\n", fs_info -> nr_devices, ASSOOFS_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    while (paths && (p = strsep(&paths, ":")) != NULL) {
+        if (!*p) continue;
+
+        if (n == fs_info -> nr_devices) {
+            printk(KERN_ERR "Too many assoofs devices, the volume has %d\n", fs_info -> nr_devices);
+            ret = -EINVAL;
+            goto err;
+        }
+
+        bdev = blkdev_get_by_path(p, ASSOOFS_DEVICE_FMODE, sb -> s_type);
+        if (IS_ERR(bdev)) {
+            printk(KERN_ERR "Cannot open assoofs device [%s]\n", p);
+            ret = PTR_ERR(bdev);
+            goto err;
+        }
+        fs_info -> bdev[n] = bdev;
+
+        ret = set_blocksize(bdev, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        if (ret) goto err;
+
+        ret = assoofs_check_member(fs_info -> sb_info, bdev, n);
+        if (ret) {
+            printk(KERN_ERR "[%s] is not member %d of this assoofs volume\n", p, n);
+            goto err;
+        }
+        n++;
+    }
+
+    if (n != fs_info -> nr_devices) {
+        printk(KERN_ERR "ASSOOFS volume has %d devices but %d were given (devices= mount option)\n", fs_info -> nr_devices, n);
+        ret = -EINVAL;
+        goto err;
+    }
+
+    return 0;
+
+err:
+    assoofs_close_devices(fs_info);
+
+    return ret;
+}
+
+/*
+ * Comprueba la cabecera que mkassoofs escribe en cada miembro: si los dispositivos de "devices=" se pasan
+ * en otro orden o alguno no es del volumen, el montaje falla en lugar de mezclar los datos repartidos.
+ */
+static int assoofs_check_member(struct assoofs_super_block_info *assoofs_sb, struct block_device *bdev, int index) {
+    struct assoofs_member_header *header;
+    struct buffer_head *bh;
+    int ret = 0;
+
+    bh = __bread(bdev, ASSOOFS_MEMBER_HEADER_BLOCK_NUMBER, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!bh) return -EIO;
+
+    header = (struct assoofs_member_header *) bh -> b_data;
+    if (header -> magic != ASSOOFS_MEMBER_MAGIC || header -> volume_id != assoofs_sb -> volume_id ||
+        header -> index != index || header -> nr_devices != assoofs_sb -> nr_devices)
+        ret = -EINVAL;
+
+    brelse(bh);
+
+    return ret;
+}
+
+static void assoofs_close_devices(struct assoofs_fs_info *fs_info) {
+    int d;
+
+    for (d = 1; d < ASSOOFS_MAX_DEVICES; d++) {
+        if (!fs_info -> bdev[d]) continue;
+
+        sync_blockdev(fs_info -> bdev[d]);
+        blkdev_put(fs_info -> bdev[d], ASSOOFS_DEVICE_FMODE);
+        fs_info -> bdev[d] = NULL;
+    }
+}
+
+static void assoofs_put_super(struct super_block *sb) {
+    struct assoofs_fs_info *fs_info = assoofs_get_fs_info(sb);
+
+    printk(KERN_INFO "assoofs_put_super request\n");
+
+    //Los descartes pendientes se lanzan ya en lugar de perderlos
+    flush_delayed_work(&fs_info -> discard_work);
+
+    assoofs_close_devices(fs_info);
+    brelse(fs_info -> bh);
+    kfree(fs_info);
+    sb -> s_fs_info = NULL;
+}
+
 static const struct super_operations assoofs_sops = {
     .drop_inode = generic_delete_inode,
+    .put_super = assoofs_put_super,
 };
 
+/*
+ *  Opciones de montaje (separadas por comas)
+ */
+static int assoofs_parse_options(char *options, struct assoofs_fs_info *fs_info) {
+    char *p;
+
+    if (!options) return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p) continue;
+
+        if (!strcmp(p, "compress")) {
+            fs_info -> mount_opts |= ASSOOFS_MOUNT_COMPRESS;
+        } else if (!strcmp(p, "dedup")) {
+            fs_info -> mount_opts |= ASSOOFS_MOUNT_DEDUP;
+        } else if (!strcmp(p, "discard")) {
+            fs_info -> mount_opts |= ASSOOFS_MOUNT_DISCARD;
+        } else if (!strncmp(p, "devices=", 8)) {
+            fs_info -> device_paths = p + 8;
+        } else {
+            printk(KERN_ERR "Unknown assoofs mount option [%s]\n", p);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /*
  *  Inicialización del superbloque
  */
 int assoofs_fill_super(struct super_block *sb, void *data, int silent) {   
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_fs_info *fs_info;
     struct inode *root_inode;
+    int ret;
+    int i;
     
     printk(KERN_INFO "assoofs_fill_super request\n");
 
+    if (!sb_set_blocksize(sb, ASSOOFS_DEFAULT_BLOCK_SIZE)) {
+        printk(KERN_ERR "ASSOOFS cannot use a block size of %d on this device\n", ASSOOFS_DEFAULT_BLOCK_SIZE);
+
+        return -EINVAL;
+    }
+
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques  
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); // sb lo recibe assoosfs_fill_super como argumento -> puntero, nº bloques que quiero leer: 0 (assoofs.h)
     assoofs_sb = (struct assoofs_super_block_info *)bh -> b_data;
@@ -545,13 +2006,53 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
         return -EPERM;
     }
 
+    //Los inodos y el superbloque de otras versiones tienen otro formato: se leerían mal
+    if (unlikely(assoofs_sb -> version != ASSOOFS_VERSION)) {
+
+        printk(KERN_ERR "ASSOOFS version %llu is not supported, reformat the device with mkassoofs (version %d)\n", assoofs_sb -> version, ASSOOFS_VERSION);
+        brelse(bh);
+
+        return -EINVAL;
+    }
+
     printk(KERN_INFO "ASSOOFS filesystem of version %llu formatted with block size of %llu detected in the device.\n", assoofs_sb -> version, assoofs_sb -> block_size);
 
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
+    fs_info = kzalloc(sizeof(struct assoofs_fs_info), GFP_KERNEL);
+    if (!fs_info) {
+        brelse(bh);
+
+        return -ENOMEM;
+    }
+    fs_info -> sb = sb;
+    fs_info -> sb_info = assoofs_sb;
+    fs_info -> bh = bh; //No se libera hasta assoofs_put_super: sb_info apunta a su contenido
+    for (i = 0; i < ASSOOFS_GROUP_COUNT; i++)
+        mutex_init(&fs_info -> group_lock[i]);
+    mutex_init(&fs_info -> inode_store_lock);
+    INIT_DELAYED_WORK(&fs_info -> discard_work, assoofs_discard_worker);
+
+    ret = assoofs_parse_options(data, fs_info);
+    if (!ret) ret = assoofs_open_devices(sb, fs_info);
+    if (ret) {
+        kfree(fs_info);
+        brelse(bh);
+
+        return ret;
+    }
+
     sb -> s_magic = ASSOOFS_MAGIC;
-    sb -> s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb -> s_maxbytes = ASSOOFS_CLUSTER_SIZE; //Cota de todo el sistema de ficheros; la de cada fichero la da assoofs_max_file_size
     sb -> s_op = &assoofs_sops; //Dirección de un var que contiene las operaciones que se pueden realizar con el superbloque
-    sb -> s_fs_info = assoofs_sb; // fs.h = libreria generica -> sistema de ficheros basados en inodos
+    sb -> s_fs_info = fs_info; // fs.h = libreria generica -> sistema de ficheros basados en inodos
+
+    if ((fs_info -> mount_opts & ASSOOFS_MOUNT_DISCARD) && !assoofs_discard_supported(sb)) {
+        printk(KERN_WARNING "assoofs: the device does not support discard, ignoring the discard mount option\n");
+        fs_info -> mount_opts &= ~ASSOOFS_MOUNT_DISCARD;
+    }
+
+    if (fs_info -> nr_devices > 1)
+        printk(KERN_INFO "ASSOOFS volume striped across %d devices with a stripe unit of %llu blocks\n", fs_info -> nr_devices, fs_info -> stripe_unit);
 
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
 
@@ -569,13 +2070,14 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     //d_add(dentry, inode);
 
     if (!sb -> s_root) { //Comprueba si ha habido algún error en s_root
+        sb -> s_fs_info = NULL;
+        assoofs_close_devices(fs_info);
+        kfree(fs_info);
         brelse(bh);
         
         return -1;
     }
 
-    brelse(bh);
-
     return 0;
 }
 
@@ -1,4 +1,6 @@
 #define ASSOOFS_MAGIC 0x20200406
+//Versión del formato en disco: la 2 añade flags/disk_size a los inodos y los campos nuevos del superbloque
+#define ASSOOFS_VERSION 2
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
 #define ASSOOFS_FILENAME_MAXLEN 255
 #define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
@@ -6,6 +8,25 @@
 //Flag para eliminar
 #define REMOVED 1
 #define NO_REMOVED 0
+//Flags del inodo (campo flags)
+#define ASSOOFS_INODE_COMPRESSED 0x1 //Los datos se comprimen con LZ4 al escribir (se hereda del directorio padre)
+//Tamaño lógico máximo de un fichero comprimido: su cluster descomprimido debe caber en un bloque una vez comprimido
+#define ASSOOFS_CLUSTER_SIZE (4 * ASSOOFS_DEFAULT_BLOCK_SIZE)
+//data_block_number de un fichero sin bloque asignado (fichero disperso, se lee como ceros). El bloque 0 es el superbloque
+#define ASSOOFS_NO_BLOCK 0
+//Nº de bloques cubiertos por el mapa de bits free_blocks (y por las tablas de deduplicación)
+#define ASSOOFS_BLOCK_MAP_SIZE 64
+//Grupos de asignación: cada uno tiene su rango de bloques (bits de free_blocks) y de inodos (bits de free_inodes)
+#define ASSOOFS_GROUP_COUNT 4
+#define ASSOOFS_BLOCKS_PER_GROUP (ASSOOFS_BLOCK_MAP_SIZE / ASSOOFS_GROUP_COUNT)
+#define ASSOOFS_INODES_PER_GROUP (ASSOOFS_BLOCK_MAP_SIZE / ASSOOFS_GROUP_COUNT)
+//Volúmenes repartidos (striping) entre varios dispositivos
+#define ASSOOFS_MAX_DEVICES 8
+//Los bloques que escribe mkassoofs (superbloque, almacén de inodos, raíz y welcomefile) quedan siempre en el dispositivo principal
+#define ASSOOFS_FIRST_STRIPED_BLOCK (ASSOOFS_LAST_RESERVED_BLOCK + 2)
+//Cabecera del resto de miembros del volumen: bloque 0 de cada uno (su zona repartida empieza en ASSOOFS_FIRST_STRIPED_BLOCK)
+#define ASSOOFS_MEMBER_MAGIC 0x20200407
+#define ASSOOFS_MEMBER_HEADER_BLOCK_NUMBER 0
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
 const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
@@ -18,7 +39,23 @@ struct assoofs_super_block_info {
     uint64_t block_size;    
     uint64_t inodes_count;
     uint64_t free_blocks;
-    char padding[4056];
+    uint64_t free_inodes; //Mapa de bits de inodos libres: el bit i corresponde al inodo i + 1
+    uint64_t hashed_blocks; //Mapa de bits de los bloques presentes en el índice de deduplicación
+    uint64_t block_hash[ASSOOFS_BLOCK_MAP_SIZE]; //xxh64 del contenido de cada bloque indexado
+    uint8_t block_refcount[ASSOOFS_BLOCK_MAP_SIZE]; //Nº de inodos que apuntan a cada bloque
+    uint64_t nr_devices; //Nº de dispositivos del volumen (0 o 1 = un único dispositivo)
+    uint64_t stripe_unit; //Bloques consecutivos que van a un mismo dispositivo antes de pasar al siguiente
+    uint64_t volume_id; //Identificador aleatorio del volumen, repetido en la cabecera de cada miembro
+    char padding[3440];
+};
+
+//Identifica un dispositivo como el miembro index (1 .. nr_devices - 1) del volumen volume_id
+struct assoofs_member_header {
+    uint64_t magic;
+    uint64_t volume_id;
+    uint64_t index;
+    uint64_t nr_devices;
+    char padding[4064];
 };
 
 
@@ -37,4 +74,25 @@ struct assoofs_inode_info {
         uint64_t file_size;
         uint64_t dir_children_count;
     };
+    uint64_t flags;
+    uint64_t disk_size; //Bytes comprimidos del cluster en el bloque de datos (0 = almacenado sin comprimir)
 };
+
+/*
+ * ioctl ASSOOFS_IOC_BULK_CREATE (sobre un directorio): crea un lote de ficheros regulares con una única
+ * escritura de metadatos. Ver bulkassoofs.c para un ejemplo de uso desde espacio de usuario.
+ */
+struct assoofs_bulk_entry {
+    uint64_t data;     //Dirección (espacio de usuario) del contenido inicial
+    uint64_t size;     //Bytes de contenido inicial (0 = fichero vacío)
+    uint64_t inode_no; //Salida: nº de inodo asignado
+    uint32_t mode;     //Permisos; el fichero siempre es regular
+    char filename[ASSOOFS_FILENAME_MAXLEN];
+};
+
+struct assoofs_bulk_create {
+    uint64_t entries;  //Dirección (espacio de usuario) del array de struct assoofs_bulk_entry
+    uint64_t count;
+};
+
+#define ASSOOFS_IOC_BULK_CREATE _IOWR('A', 1, struct assoofs_bulk_create)
@@ -0,0 +1,120 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include "assoofs.h"
+
+//Envoltorio del ioctl ASSOOFS_IOC_BULK_CREATE: crea count ficheros en el directorio dirfd con una única escritura de metadatos
+int assoofs_bulk_create(int dirfd, struct assoofs_bulk_entry *entries, uint64_t count) {
+    struct assoofs_bulk_create req = {
+        .entries = (uintptr_t) entries,
+        .count = count,
+    };
+
+    return ioctl(dirfd, ASSOOFS_IOC_BULK_CREATE, &req);
+}
+
+//Rellena una entrada del lote con el nombre, permisos y contenido de un fichero local
+static int read_source(char *path, struct assoofs_bulk_entry *entry) {
+    struct stat st;
+    char *name = basename(path);
+    char *body;
+    ssize_t ret;
+    int fd;
+
+    //Un nombre truncado podría coincidir con otro y fallar con un EEXIST confuso
+    if (strlen(name) >= ASSOOFS_FILENAME_MAXLEN) {
+        printf("The file name %s is too long (at most %d characters).\n", name, ASSOOFS_FILENAME_MAXLEN - 1);
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    body = malloc(st.st_size ? st.st_size : 1);
+    if (!body) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    ret = read(fd, body, st.st_size);
+    close(fd);
+    if (ret != st.st_size) {
+        printf("Reading %s has failed.\n", path);
+        free(body);
+        return -1;
+    }
+
+    strcpy(entry -> filename, name);
+    entry -> mode = st.st_mode & 07777;
+    entry -> data = (uintptr_t) body;
+    entry -> size = st.st_size;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct assoofs_bulk_entry *entries;
+    int count;
+    int fd;
+    int ret;
+    int i;
+
+    if (argc < 3) {
+        printf("Usage: bulkassoofs <assoofs directory> <file>...\n");
+        return -1;
+    }
+
+    fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("Error opening the directory");
+        return -1;
+    }
+
+    count = argc - 2;
+    entries = calloc(count, sizeof(*entries));
+    if (!entries) {
+        perror("Error allocating the batch");
+        close(fd);
+        return -1;
+    }
+
+    ret = 1;
+    do {
+        for (i = 0; i < count; i++)
+            if (read_source(argv[i + 2], &entries[i]))
+                break;
+        if (i < count)
+            break;
+
+        if (assoofs_bulk_create(fd, entries, count)) {
+            perror("Bulk create has failed");
+            break;
+        }
+
+        for (i = 0; i < count; i++)
+            printf("%s created with inode %llu.\n", entries[i].filename, (unsigned long long) entries[i].inode_no);
+
+        ret = 0;
+    } while (0);
+
+    for (i = 0; i < count; i++)
+        free((void *) (uintptr_t) entries[i].data);
+    free(entries);
+    close(fd);
+    return ret;
+}
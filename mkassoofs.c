@@ -6,18 +6,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "assoofs.h"
 
 #define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1) //Se coge el último inodo reservado(raiz) y le sumo 1
  
-static int write_superblock(int fd) {
+static int write_superblock(int fd, uint64_t nr_devices, uint64_t stripe_unit, uint64_t volume_id) {
     struct assoofs_super_block_info sb = { //Declara struct sb
-        .version = 1,
+        .version = ASSOOFS_VERSION,
         .magic = ASSOOFS_MAGIC,
         .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE, //constante predefinida
         .inodes_count = WELCOMEFILE_INODE_NUMBER,
         .free_blocks = (~0) & ~(15), 
+        .free_inodes = (~0) & ~(3), //Inodos 1 (raíz) y 2 (welcomefile)
+        .block_refcount = { 1, 1, 1, 1 }, //superbloque, almacén de inodos, directorio raíz y welcomefile
+        .nr_devices = nr_devices,
+        .stripe_unit = stripe_unit,
+        .volume_id = volume_id,
     };
     ssize_t ret;
 
@@ -40,6 +46,8 @@ static int write_root_inode(int fd) {
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
     root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
     root_inode.dir_children_count = 1;
+    root_inode.flags = 0;
+    root_inode.disk_size = 0;
 
     ret = write(fd, &root_inode, sizeof(root_inode));
 
@@ -106,10 +114,60 @@ int write_block(int fd, char *block, size_t len) {
     return 0;
 }
 
+//Identificador aleatorio del volumen, para reconocer sus miembros al montar
+static uint64_t new_volume_id(void) {
+    uint64_t id = 0;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd != -1) {
+        if (read(fd, &id, sizeof(id)) != sizeof(id))
+            id = 0;
+        close(fd);
+    }
+    if (!id)
+        id = ((uint64_t) time(NULL) << 32) ^ getpid();
+
+    return id;
+}
+
+//Cabecera en el bloque 0 de cada dispositivo del volumen salvo el principal
+static int write_member_header(char *path, uint64_t index, uint64_t nr_devices, uint64_t volume_id) {
+    struct assoofs_member_header header = {
+        .magic = ASSOOFS_MEMBER_MAGIC,
+        .volume_id = volume_id,
+        .index = index,
+        .nr_devices = nr_devices,
+    };
+    ssize_t ret;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        perror("Error opening the member device");
+        return -1;
+    }
+
+    ret = write(fd, &header, sizeof(header));
+    close(fd);
+    if (ret != sizeof(header)) {
+        printf("Writing the member header of %s has failed.\n", path);
+        return -1;
+    }
+
+    printf("member %llu header written succesfully in %s.\n", (unsigned long long) index, path);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int fd;
+    int opt;
     ssize_t ret;
+    uint64_t nr_devices;
+    uint64_t i;
+    uint64_t stripe_unit = 1;
+    uint64_t volume_id;
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
     
     struct assoofs_inode_info welcome = {
@@ -126,12 +184,27 @@ int main(int argc, char *argv[])
 	    .remove_flag = NO_REMOVED,
     };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    //-u: unidad de reparto en bloques. Tras el dispositivo principal van el resto de miembros, en el orden que se pasarán al montar (devices=)
+    while ((opt = getopt(argc, argv, "u:")) != -1) {
+        switch (opt) {
+        case 'u':
+            stripe_unit = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    nr_devices = argc - optind;
+    if (nr_devices < 1 || nr_devices > ASSOOFS_MAX_DEVICES || stripe_unit < 1) {
+        printf("Usage: mkassoofs [-u stripe_unit] <device> [<member device>...] (up to %d devices)\n", ASSOOFS_MAX_DEVICES);
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR);
+    volume_id = new_volume_id();
+
+    fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
@@ -139,7 +212,7 @@ int main(int argc, char *argv[])
 
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (write_superblock(fd, nr_devices, stripe_unit, volume_id))
             break;
 
         if (write_root_inode(fd))
@@ -154,6 +227,12 @@ int main(int argc, char *argv[])
         if (write_block(fd, welcomefile_body, welcome.file_size))
             break;
 
+        for (i = 1; i < nr_devices; i++)
+            if (write_member_header(argv[optind + i], i, nr_devices, volume_id))
+                break;
+        if (i < nr_devices)
+            break;
+
         ret = 0;
     } while (0);
 